@@ -25,9 +25,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "MeanSpikeRateEditor.h"
 
 MeanSpikeRate::MeanSpikeRate() : GenericProcessor("Mean Spike Rate")
+    , audioCoefficientVersion(0)
+    , recordHistory(false)
+    , historyRateHz(100.0f)
 {
     addSelectedChannelsParameter(Parameter::STREAM_SCOPE, "Output", OUTPUT_TOOLTIP, 1);
     addFloatParameter(Parameter::STREAM_SCOPE, "Time_Const", TIME_CONST_TOOLTIP, 1000.0, 1, std::numeric_limits<float>::max(), 0.001);
+    addCategoricalParameter(Parameter::STREAM_SCOPE, "Warm_Start", WARM_START_TOOLTIP, { "None", "Last", "Prefill" }, NO_WARM_START, true);
+
+    addBooleanParameter(Parameter::GLOBAL_SCOPE, "Record_History", RECORD_HISTORY_TOOLTIP, false, true);
+    addFloatParameter(Parameter::GLOBAL_SCOPE, "History_Hz", HISTORY_RATE_TOOLTIP, 100.0, 1, 1000, 1, true);
 }
 
 MeanSpikeRate::~MeanSpikeRate() {
@@ -41,13 +48,23 @@ AudioProcessorEditor* MeanSpikeRate::createEditor()
 
 void MeanSpikeRate::process(AudioBuffer<float>& continuousBuffer)
 {
+    updateAudioCoefficients();
+
+    // set up each stream for this buffer
     for (auto stream : getDataStreams())
     {
         // Get parameters for current stream
         const uint16 streamId = stream->getStreamId();
-        MeanSpikeRateSettings* msrSettings = settings[streamId];
-        float timeConstMs = msrSettings->timeConstMs;
-        int outputChan = msrSettings->outputChan;
+        int outputChan = settings[streamId]->outputChan;
+
+        auto it = streamState.find(streamId);
+        if (it == streamState.end())
+        {
+            continue;
+        }
+
+        MeanSpikeRateState& state = it->second;
+        state.wpBuffer = nullptr;
 
         uint32 numSamples;
         if (getNumInputs() == 0 || (numSamples = getNumSamplesInBlock(streamId)) == 0)
@@ -62,42 +79,37 @@ void MeanSpikeRate::process(AudioBuffer<float>& continuousBuffer)
             continue;
         }
 
-        // update algorithm parameters
-        // we assume each spike channel has the same sample rate as the selected channel.
-        // if not, this would get a lot more complicated.
-        int numActiveElectrodes = 0;
-        for (auto spikeChannel : stream->getSpikeChannels())
-        {
-            numActiveElectrodes += isActive(spikeChannel);
-        }
-        if (numActiveElectrodes == 0)
+        if (state.coefficients == nullptr || state.coefficients->numActiveElectrodes == 0)
         {
             continue;
         }
-        double timeConstSec = timeConstMs / 1000.0;
-        
-        //double timeConstSamp = timeConstSec * getDataChannel(outputChan)->getSampleRate();
-        double timeConstSamp = timeConstSec * getSampleRate(streamId);
-        decayPerSample[streamId] = exp(-1 / timeConstSamp);
-
-        // the initial amplitude of each spike such that if there is a steady rate of
-        // spiking, the average over time of the exponentially weighted mean
-        // (at the limit where the process has been continuing forever)
-        // equals the actual spike rate in Hz. This is just 1 / (time const in sec).
-        spikeAmp[streamId] = 1 / (timeConstSec * numActiveElectrodes);
 
         // initialize first sample
-        currSample[streamId] = 0;
+        state.currSample = 0;
+        state.wpBuffer = continuousBuffer.getWritePointer(outputChan);
+    }
 
-        // handle each spike, calculating the mean spike rate of samples in between.
-        checkForEvents(true);
+    // handle each spike, calculating the mean spike rate of samples in between.
+    checkForEvents(true);
 
-        // after all spikes are handled, finish writing samples
-        wpBuffer[streamId] = continuousBuffer.getWritePointer(outputChan);
-        for (int samp = currSample[streamId]; samp < numSamples; ++samp)
+    // after all spikes are handled, finish writing samples
+    for (auto stream : getDataStreams())
+    {
+        const uint16 streamId = stream->getStreamId();
+
+        auto it = streamState.find(streamId);
+        if (it == streamState.end() || it->second.wpBuffer == nullptr)
         {
-            wpBuffer[streamId][samp] = currMean[streamId];
-            currMean[streamId] *= decayPerSample[streamId];
+            continue;
+        }
+
+        MeanSpikeRateState& state = it->second;
+        const int numSamples = getNumSamplesInBlock(streamId);
+        writeSamples(state, numSamples);
+
+        if (historyRecorder.isRecording())
+        {
+            historyRecorder.pushBlock(streamId, getFirstSampleNumberForBlock(streamId), state.wpBuffer, numSamples);
         }
     }
     
@@ -105,67 +117,510 @@ void MeanSpikeRate::process(AudioBuffer<float>& continuousBuffer)
 void MeanSpikeRate::handleSpike(SpikePtr spike)
 {
     Spike* spikeEvent = spike.get();
+    const SpikeChannel* spikeChannel = spikeEvent->spikeChannel;
+
+    auto it = streamState.find(spikeChannel->getStreamId());
+    if (it == streamState.end() || it->second.wpBuffer == nullptr)
+    {
+        return; // stream not processed in this buffer
+    }
+
+    MeanSpikeRateState& state = it->second;
+    const MeanSpikeRateCoefficients& coeffs = *state.coefficients;
 
     //Check if spike channel is enabled
-    const SpikeChannel* spikeChannel = spikeEvent->spikeChannel;
-    if (!isActive(spikeChannel))
+    const int localIndex = spikeChannel->getLocalIndex();
+    if (!isPositiveAndBelow(localIndex, (int)coeffs.active.size()) || !coeffs.active[localIndex])
     {
         return;
     }
 
-    int streamId = spikeChannel->getStreamId();
     int samplePosition = spikeChannel->currentSampleIndex;
 
-    jassert(samplePosition >= currSample[streamId]); // spike sample must not have already been finished
+    jassert(samplePosition >= state.currSample); // spike sample must not have already been finished
 
     // write samples up to the spike position
-    for (int samp = currSample[streamId]; samp < samplePosition; ++samp)
+    writeSamples(state, samplePosition);
+
+    if (state.prefillRemaining > 0)
     {
-        wpBuffer[streamId][samp] = currMean[streamId]; //problem 
-        currMean[streamId] *= decayPerSample[streamId];
+        state.prefillCount++;
     }
-    currSample[streamId] = samplePosition;
 
     // add spike contribution
-    currMean[streamId] += spikeAmp[streamId];
+    state.currMean += coeffs.spikeAmp;
+}
+
+void MeanSpikeRate::writeSamples(MeanSpikeRateState& state, int endSample)
+{
+    const MeanSpikeRateCoefficients& coeffs = *state.coefficients;
+    float* wp = state.wpBuffer;
+    double mean = state.currMean;
+    int samp = state.currSample;
+    int64& remaining = state.prefillRemaining;
+
+    while (samp < endSample)
+    {
+        // stop at the end of the prefill window if it falls in this segment
+        int segmentEnd = endSample;
+        if (remaining > 0 && remaining < endSample - samp)
+        {
+            segmentEnd = samp + (int)remaining;
+        }
+
+        if (remaining > 0)
+        {
+            remaining -= segmentEnd - samp;
+        }
+
+        // fill the segment from the decay power table
+        while (samp < segmentEnd)
+        {
+            const int n = jmin(segmentEnd - samp, (int)MeanSpikeRateCoefficients::DECAY_TABLE_SIZE);
+            for (int i = 0; i < n; ++i)
+            {
+                wp[samp + i] = float(mean * coeffs.decayPower[i]);
+            }
+            mean *= coeffs.decayPower[n];
+            samp += n;
+        }
+
+        // add the history that was missed before acquisition started, assuming
+        // the rate seen in the prefill window
+        if (remaining == 0 && state.prefillCount > 0)
+        {
+            mean += state.prefillCount * coeffs.prefillSeedPerSpike;
+            state.prefillCount = 0;
+        }
+    }
+
+    state.currMean = float(mean);
+    state.currSample = endSample;
+}
+
+void MeanSpikeRate::updateCoefficients(const DataStream* stream)
+{
+    if (stream == nullptr)
+    {
+        return;
+    }
+
+    const uint16 streamId = stream->getStreamId();
+    auto coeffs = std::make_unique<MeanSpikeRateCoefficients>();
+
+    // we assume each spike channel has the same sample rate as the selected channel.
+    // if not, this would get a lot more complicated.
+    coeffs->active.assign(stream->getSpikeChannels().size(), false);
+    for (auto spikeChannel : stream->getSpikeChannels())
+    {
+        const int localIndex = spikeChannel->getLocalIndex();
+        if (isPositiveAndBelow(localIndex, (int)coeffs->active.size()) && isActive(spikeChannel))
+        {
+            coeffs->active[localIndex] = true;
+            coeffs->numActiveElectrodes++;
+        }
+    }
+
+    double timeConstSec = settings[streamId]->timeConstMs / 1000.0;
+    double timeConstSamp = timeConstSec * stream->getSampleRate();
+    coeffs->decayPerSample = exp(-1 / timeConstSamp);
+    coeffs->oneMinusDecay = -expm1(-1 / timeConstSamp);
+
+    // the initial amplitude of each spike such that if there is a steady rate of
+    // spiking, the average over time of the exponentially weighted mean
+    // (at the limit where the process has been continuing forever)
+    // equals the actual spike rate in Hz. This is just 1 / (time const in sec).
+    if (coeffs->numActiveElectrodes > 0)
+    {
+        coeffs->spikeAmp = 1 / (timeConstSec * coeffs->numActiveElectrodes);
+    }
+
+    // with a steady rate of count / W spikes per sample, the spikes before the start of a
+    // prefill window of W samples would have added count * spikeAmp * decay^W / (W * (1 - decay))
+    const double prefillMs = jmin((double)settings[streamId]->timeConstMs, PREFILL_WINDOW_MS);
+    coeffs->prefillSamples = jmax((int64)1, (int64)roundToInt(prefillMs / 1000.0 * stream->getSampleRate()));
+    coeffs->prefillSeedPerSpike = coeffs->spikeAmp * pow(coeffs->decayPerSample, (double)coeffs->prefillSamples)
+        / (coeffs->prefillSamples * coeffs->oneMinusDecay);
+
+    coeffs->decayPower[0] = 1.0;
+    for (int k = 1; k <= MeanSpikeRateCoefficients::DECAY_TABLE_SIZE; ++k)
+    {
+        coeffs->decayPower[k] = coeffs->decayPower[k - 1] * coeffs->decayPerSample;
+    }
+
+    const SpinLock::ScopedLockType lock(coefficientLock);
+    coeffs->version = ++coefficientVersion;
+    pendingCoefficients[streamId] = std::move(coeffs);
+}
+
+void MeanSpikeRate::updateAudioCoefficients()
+{
+    if (coefficientVersion.get() == audioCoefficientVersion)
+    {
+        return;
+    }
+
+    // never wait on the message thread; try again next buffer if it is busy
+    const SpinLock::ScopedTryLockType lock(coefficientLock);
+    if (lock.isLocked())
+    {
+        swapInCoefficients();
+    }
+}
+
+void MeanSpikeRate::swapInCoefficients()
+{
+    // called with coefficientLock held. Swapping (rather than copying) leaves the
+    // previous coefficients in pendingCoefficients, to be freed on the message thread.
+    for (auto& entry : pendingCoefficients)
+    {
+        auto it = streamState.find(entry.first);
+        if (it == streamState.end() || entry.second == nullptr)
+        {
+            continue;
+        }
+
+        std::unique_ptr<MeanSpikeRateCoefficients>& current = it->second.coefficients;
+        if (current == nullptr || entry.second->version > current->version)
+        {
+            std::swap(current, entry.second);
+        }
+    }
+
+    audioCoefficientVersion = coefficientVersion.get();
+}
+
+bool MeanSpikeRate::isActive(const SpikeChannel* chan)
+{
+    const DataStream* stream = getDataStream(chan->getStreamId());
+    if (stream == nullptr)
+    {
+        return false;
+    }
+
+    auto it = spikeChannelSelection.find(getStreamKey(stream));
+    if (it == spikeChannelSelection.end())
+    {
+        return false;
+    }
+
+    const int localIndex = chan->getLocalIndex();
+    return isPositiveAndBelow(localIndex, (int)it->second.size()) && it->second[localIndex];
+}
+
+void MeanSpikeRate::setActive(uint16 streamId, int localIndex, bool active)
+{
+    const DataStream* stream = getDataStream(streamId);
+    if (stream == nullptr || localIndex < 0)
+    {
+        return;
+    }
+
+    std::vector<bool>& selection = spikeChannelSelection[getStreamKey(stream)];
+    if (localIndex >= (int)selection.size())
+    {
+        selection.resize(localIndex + 1, false);
+    }
+    selection[localIndex] = active;
+
+    updateCoefficients(stream);
 }
 
 void MeanSpikeRate::updateSettings()
 {
     settings.update(getDataStreams());
 
+    // Update settings objects in one pass, without going through parameterValueChanged
     for (auto stream : getDataStreams())
     {
-        // Update settings objects
-        parameterValueChanged(stream->getParameter("Output"));
-        parameterValueChanged(stream->getParameter("Time_Const"));
+        MeanSpikeRateSettings* msrSettings = settings[stream->getStreamId()];
+        msrSettings->outputChan = getOutputChannel(stream, stream->getParameter("Output"));
+        msrSettings->timeConstMs = (float)stream->getParameter("Time_Const")->getValue();
+        msrSettings->warmStart = (int)stream->getParameter("Warm_Start")->getValue();
     }
+
+    removeStaleStreams();
+    applySpikeChannelSelection();
+
+    for (auto stream : getDataStreams())
+    {
+        streamState[stream->getStreamId()]; // create the audio thread's state for new streams
+        updateCoefficients(stream);
+    }
+
+    {
+        const SpinLock::ScopedLockType lock(coefficientLock);
+        swapInCoefficients();
+    }
+
+    parameterValueChanged(getParameter("Record_History"));
+    parameterValueChanged(getParameter("History_Hz"));
 }
 
 void MeanSpikeRate::parameterValueChanged(Parameter* param)
 {
     const uint16 streamId = param->getStreamId();
 
-    if (param->getName().equalsIgnoreCase("Output"))
+    if (param->getName().equalsIgnoreCase("Record_History"))
+    {
+        recordHistory = (bool)param->getValue();
+    }
+    else if (param->getName().equalsIgnoreCase("History_Hz"))
+    {
+        historyRateHz = (float)param->getValue();
+    }
+    else if (param->getName().equalsIgnoreCase("Output"))
+    {
+        settings[streamId]->outputChan = getOutputChannel(getDataStream(streamId), param);
+    }
+    else if (param->getName().equalsIgnoreCase("Time_Const"))
+    {
+        settings[streamId]->timeConstMs = (float)param->getValue();
+        updateCoefficients(getDataStream(streamId));
+    }
+    else if (param->getName().equalsIgnoreCase("Warm_Start"))
+    {
+        settings[streamId]->warmStart = (int)param->getValue();
+    }
+}
+
+int MeanSpikeRate::getOutputChannel(const DataStream* stream, Parameter* param)
+{
+    Array<var>* array = param->getValue().getArray();
+
+    // Make sure there's a selected value
+    if (array == nullptr || array->size() == 0)
+    {
+        return -1;
+    }
+
+    int localIndex = int(array->getFirst());
+    const auto& streamChannels = stream->getContinuousChannels();
+    if (!isPositiveAndBelow(localIndex, streamChannels.size()))
+    {
+        return -1;
+    }
+
+    return streamChannels[localIndex]->getGlobalIndex();
+}
+
+String MeanSpikeRate::getStreamKey(const DataStream* stream)
+{
+    // stream IDs are assigned at runtime, so saved state is keyed by source node and name
+    return String(stream->getSourceNodeId()) + "|" + stream->getName();
+}
+
+void MeanSpikeRate::removeStaleStreams()
+{
+    StringArray streamKeys;
+    Array<uint16> streamIds;
+    for (auto stream : getDataStreams())
     {
-        Array<var>* array = param->getValue().getArray();
+        streamKeys.add(getStreamKey(stream));
+        streamIds.add(stream->getStreamId());
+    }
 
-        // Make sure there's a selected value
-        if (array->size() > 0)
+    // a removed stream's selection is kept as pending, so it is saved and restored if the stream returns
+    for (auto it = spikeChannelSelection.begin(); it != spikeChannelSelection.end();)
+    {
+        if (streamKeys.contains(it->first))
         {
-            int localIndex = int(array->getFirst());
-            int globalIndex = getDataStream(streamId)->getContinuousChannels()[localIndex]->getGlobalIndex();
-            settings[streamId]->outputChan = globalIndex;
+            ++it;
+            continue;
         }
-        else
+
+        const std::vector<bool>& selection = it->second;
+        if (std::find(selection.begin(), selection.end(), true) != selection.end()
+            && pendingStreamSelection.count(it->first) == 0)
         {
-            settings[streamId]->outputChan = -1;
+            pendingStreamSelection[it->first] = selection;
         }
+
+        selectionIdentifiers.erase(it->first);
+        it = spikeChannelSelection.erase(it);
     }
-    else if (param->getName().equalsIgnoreCase("Time_Const"))
+
+    // audio thread state is keyed by stream ID, which changes when a stream is re-created
+    for (auto it = streamState.begin(); it != streamState.end();)
     {
-        settings[streamId]->timeConstMs = (float)param->getValue();
+        it = streamIds.contains(it->first) ? std::next(it) : streamState.erase(it);
+    }
+
+    const SpinLock::ScopedLockType lock(coefficientLock);
+    for (auto it = pendingCoefficients.begin(); it != pendingCoefficients.end();)
+    {
+        it = streamIds.contains(it->first) ? std::next(it) : pendingCoefficients.erase(it);
+    }
+}
+
+void MeanSpikeRate::applySpikeChannelSelection()
+{
+    for (auto stream : getDataStreams())
+    {
+        const String streamKey = getStreamKey(stream);
+
+        StringArray identifiers;
+        for (auto spikeChannel : stream->getSpikeChannels())
+        {
+            identifiers.add(spikeChannel->getIdentifier());
+        }
+
+        std::vector<bool>& selection = spikeChannelSelection[streamKey];
+        StringArray& previousIdentifiers = selectionIdentifiers[streamKey];
+
+        auto pending = pendingStreamSelection.find(streamKey);
+        if (pending != pendingStreamSelection.end())
+        {
+            // selection was loaded by index; wait until the channels are known
+            if (identifiers.isEmpty())
+            {
+                continue;
+            }
+
+            if ((int)pending->second.size() == identifiers.size())
+            {
+                selection = pending->second;
+            }
+            else
+            {
+                LOGC("Mean Spike Rate: saved selection for ", stream->getName(), " has ", (int)pending->second.size(),
+                    " spike channels, but the stream has ", identifiers.size(), "; leaving it unselected");
+                selection.assign(identifiers.size(), false);
+            }
+
+            pendingStreamSelection.erase(pending);
+        }
+        else if (previousIdentifiers != identifiers)
+        {
+            // spike channels were added, removed or reordered upstream
+            std::map<String, bool> previous;
+            for (int i = 0; i < previousIdentifiers.size() && i < (int)selection.size(); ++i)
+            {
+                previous[previousIdentifiers[i]] = selection[i];
+            }
+
+            selection.assign(identifiers.size(), false);
+            for (int i = 0; i < identifiers.size(); ++i)
+            {
+                auto it = previous.find(identifiers[i]);
+                if (it != previous.end())
+                {
+                    selection[i] = it->second;
+                }
+            }
+        }
+
+        selection.resize(identifiers.size(), false);
+
+        // apply entries loaded from per-channel XML
+        if (!pendingSelection.empty())
+        {
+            for (int i = 0; i < identifiers.size(); ++i)
+            {
+                auto it = pendingSelection.find(identifiers[i]);
+                if (it != pendingSelection.end())
+                {
+                    selection[i] = it->second;
+                    pendingSelection.erase(it);
+                }
+            }
+        }
+
+        previousIdentifiers = identifiers;
+    }
+}
+
+bool MeanSpikeRate::startAcquisition()
+{
+    // pick up changes made since the last update, so the prefill window is current
+    {
+        const SpinLock::ScopedLockType lock(coefficientLock);
+        swapInCoefficients();
+    }
+
+    for (auto stream : getDataStreams())
+    {
+        const uint16 streamId = stream->getStreamId();
+        const String streamKey = getStreamKey(stream);
+        int warmStart = settings[streamId]->warmStart;
+
+        auto it = streamState.find(streamId);
+        if (it == streamState.end() || it->second.coefficients == nullptr)
+        {
+            continue;
+        }
+
+        if (warmStart == LAST_SNAPSHOT && snapshotMean.count(streamKey) == 0)
+        {
+            warmStart = PREFILL;
+        }
+
+        MeanSpikeRateState& state = it->second;
+        state.currMean = warmStart == LAST_SNAPSHOT ? snapshotMean[streamKey] : 0.0f;
+        state.prefillRemaining = warmStart == PREFILL ? state.coefficients->prefillSamples : 0;
+        state.prefillCount = 0;
+    }
+
+    if (!recordHistory)
+    {
+        return true;
+    }
+
+    Array<RateHistoryStreamInfo> streams;
+    for (auto stream : getDataStreams())
+    {
+        streams.add({ stream->getStreamId(), stream->getSampleRate(), 1 });
     }
+
+    // restarting within the same second gets a new name rather than reusing the last file
+    File historyFile = CoreServices::getRecordingParentDirectory().getChildFile(
+        "MeanSpikeRate_" + String(getNodeId()) + "_" + Time::getCurrentTime().formatted("%Y-%m-%d_%H-%M-%S") + ".msrh")
+        .getNonexistentSibling();
+
+    if (!historyRecorder.start(historyFile, historyRateHz, streams))
+    {
+        LOGE("Mean Spike Rate: could not open rate history file ", historyFile.getFullPathName());
+    }
+
+    return true;
+}
+
+bool MeanSpikeRate::stopAcquisition()
+{
+    for (auto stream : getDataStreams())
+    {
+        auto it = streamState.find(stream->getStreamId());
+        if (it == streamState.end() || it->second.coefficients == nullptr)
+        {
+            continue;
+        }
+
+        const MeanSpikeRateState& state = it->second;
+        double mean = state.currMean;
+
+        // if stopped during the prefill window, add the missing history for the part seen so far
+        const MeanSpikeRateCoefficients& coeffs = *state.coefficients;
+        const int64 elapsed = coeffs.prefillSamples - state.prefillRemaining;
+        if (state.prefillRemaining > 0 && elapsed > 0)
+        {
+            mean += state.prefillCount * coeffs.spikeAmp * pow(coeffs.decayPerSample, (double)elapsed)
+                / (elapsed * coeffs.oneMinusDecay);
+        }
+
+        snapshotMean[getStreamKey(stream)] = float(mean);
+    }
+
+    if (historyRecorder.isRecording())
+    {
+        historyRecorder.stop();
+
+        if (historyRecorder.getNumDropped() > 0)
+        {
+            LOGC("Mean Spike Rate: dropped ", historyRecorder.getNumDropped(), " rate history values");
+        }
+    }
+
+    return true;
 }
 
 int MeanSpikeRate::getNumActiveElectrodes()
@@ -184,22 +639,103 @@ void MeanSpikeRate::loadCustomParametersFromXml(XmlElement* parentElement)
     {
         if (mainNode->hasTagName("MeanSpikeRate"))
         {
-            forEachXmlChildElement(*mainNode, activeNode)
+            forEachXmlChildElement(*mainNode, childNode)
             {
-                spikeChannelActive[activeNode->getStringAttribute("channel")] = activeNode->getBoolAttribute("isActive");
+                if (childNode->hasTagName("SELECTION"))
+                {
+                    // one bit per spike channel, by local index
+                    const int count = childNode->getIntAttribute("count");
+
+                    MemoryBlock bits;
+                    bits.fromBase64Encoding(childNode->getStringAttribute("bits"));
+                    const uint8* bytes = static_cast<const uint8*>(bits.getData());
+
+                    std::vector<bool>& selection = pendingStreamSelection[childNode->getStringAttribute("stream")];
+                    selection.assign(jmax(0, count), false);
+                    for (int i = 0; i < count && (size_t)(i >> 3) < bits.getSize(); ++i)
+                    {
+                        selection[i] = (bytes[i >> 3] >> (i & 7)) & 1;
+                    }
+                }
+                else if (childNode->hasTagName("ACTIVE"))
+                {
+                    // per-channel format written by earlier versions
+                    pendingSelection[childNode->getStringAttribute("channel")] = childNode->getBoolAttribute("isActive");
+                }
+                else if (childNode->hasTagName("SNAPSHOT"))
+                {
+                    snapshotMean[childNode->getStringAttribute("stream")] = (float)childNode->getDoubleAttribute("mean");
+                }
             }
         }
     }
+
+    applySpikeChannelSelection();
+
+    for (auto stream : getDataStreams())
+    {
+        updateCoefficients(stream);
+    }
 }
 
 void MeanSpikeRate::saveCustomParametersToXml(XmlElement* parentElement)
 {
     auto editor = static_cast<MeanSpikeRateEditor*>(getEditor());
     XmlElement* mainNode = parentElement->createNewChildElement("MeanSpikeRate");
-    for (auto spikeChannel : spikeChannels)
+
+    // selections that have not been matched to a stream yet are written back unchanged
+    std::map<String, std::vector<bool>> selections = pendingStreamSelection;
+    for (auto stream : getDataStreams())
+    {
+        const String streamKey = getStreamKey(stream);
+        if (selections.count(streamKey) > 0)
+        {
+            continue;
+        }
+
+        std::vector<bool>& selection = selections[streamKey];
+        selection.assign(stream->getSpikeChannels().size(), false);
+        for (auto spikeChannel : stream->getSpikeChannels())
+        {
+            const int localIndex = spikeChannel->getLocalIndex();
+            if (isPositiveAndBelow(localIndex, (int)selection.size()) && isActive(spikeChannel))
+            {
+                selection[localIndex] = true;
+            }
+        }
+    }
+
+    for (auto& entry : selections)
+    {
+        const int count = (int)entry.second.size();
+
+        MemoryBlock bits((count + 7) / 8, true);
+        uint8* bytes = static_cast<uint8*>(bits.getData());
+        for (int i = 0; i < count; ++i)
+        {
+            if (entry.second[i])
+            {
+                bytes[i >> 3] |= uint8(1 << (i & 7));
+            }
+        }
+
+        XmlElement* selectionNode = mainNode->createNewChildElement("SELECTION");
+        selectionNode->setAttribute("stream", entry.first);
+        selectionNode->setAttribute("count", count);
+        selectionNode->setAttribute("bits", bits.toBase64Encoding());
+    }
+
+    for (auto& entry : pendingSelection)
     {
         XmlElement* activeNode = mainNode->createNewChildElement("ACTIVE");
-        activeNode->setAttribute("channel", spikeChannel->getIdentifier());
-        activeNode->setAttribute("isActive", isActive(spikeChannel));
+        activeNode->setAttribute("channel", entry.first);
+        activeNode->setAttribute("isActive", entry.second);
+    }
+
+    for (auto& snapshot : snapshotMean)
+    {
+        XmlElement* snapshotNode = mainNode->createNewChildElement("SNAPSHOT");
+        snapshotNode->setAttribute("stream", snapshot.first);
+        snapshotNode->setAttribute("mean", snapshot.second);
     }
 }
\ No newline at end of file
@@ -25,6 +25,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MEAN_SPIKE_RATE_H_INCLUDED
 
 #include <ProcessorHeaders.h>
+#include "RateHistoryRecorder.h"
+
+#include <array>
 
 
 /**
@@ -36,8 +39,45 @@ class MeanSpikeRateSettings {
 public:
     float timeConstMs;
     int outputChan;
+    int warmStart;
+
+
+};
+
+/**
+
+    Per-stream values derived from the settings and the electrode selection.
+    Rebuilt on the message thread only when one of them changes.
+
+*/
+class MeanSpikeRateCoefficients {
+public:
+    static const int DECAY_TABLE_SIZE = 1024;
+
+    int version = 0;
+    std::vector<bool> active;     // selection state by spike channel local index
+    int numActiveElectrodes = 0;
+    double decayPerSample = 1.0;
+    double spikeAmp = 0.0;
+    double oneMinusDecay = 0.0;   // 1 - decayPerSample, computed without cancellation
+    int64 prefillSamples = 1;
+    double prefillSeedPerSpike = 0.0;
+    std::array<double, DECAY_TABLE_SIZE + 1> decayPower;   // decayPerSample^k, for filling segments
+};
 
+/**
+
+    Estimator state for each data stream, used on the audio thread
 
+*/
+class MeanSpikeRateState {
+public:
+    float* wpBuffer = nullptr;      // nullptr if the stream is not processed in this buffer
+    int currSample = 0;             // per-buffer - allows processing samples while handling events
+    float currMean = 0.0f;
+    int64 prefillRemaining = 0;     // samples left in the prefill window, 0 if not prefilling
+    int prefillCount = 0;           // active spikes seen in the prefill window
+    std::unique_ptr<MeanSpikeRateCoefficients> coefficients;
 };
 
 /* Estimates the mean spike rate over time and channels. Uses an exponentially
@@ -62,8 +102,11 @@ public:
     /** Creates the custom editor for this processor */
     AudioProcessorEditor* createEditor() override;
 
-    /** Checks whether an incoming spike channel is selected */
-    bool isActive(const SpikeChannel* chan) { return spikeChannelActive[chan->getIdentifier()]; };
+    /** Checks whether a spike channel is selected (the audio thread uses the mask in its coefficients) */
+    bool isActive(const SpikeChannel* chan);
+
+    /** Sets the selection state of a spike channel by stream and local index */
+    void setActive(uint16 streamId, int localIndex, bool active);
 
     /** Overwrites continuous data with average spike rate */
     void process(AudioBuffer<float>& continuousBuffer) override;
@@ -74,30 +117,71 @@ public:
     /** Called when a parameter is changed */
     void parameterValueChanged(Parameter* param) override;
 
+    /** Seeds the estimator state and starts the rate history recorder, if enabled */
+    bool startAcquisition() override;
+
+    /** Snapshots the estimator state and stops the rate history recorder */
+    bool stopAcquisition() override;
+
     /** Loads spike channel selection state. */
     void loadCustomParametersFromXml(XmlElement* parentElement) override;
 
     /** Saves spike channel selection state. */
     void saveCustomParametersToXml(XmlElement* parentElement) override;
 
+    /** Options for initializing the estimator when acquisition starts */
+    enum WarmStart
+    {
+        NO_WARM_START = 0, // start from zero
+        LAST_SNAPSHOT,     // start from the mean at the end of the last acquisition (falls back to PREFILL)
+        PREFILL            // seed the missing history from the spike count in a short window
+    };
+
 private:
 
-    std::map<String, bool> spikeChannelActive;
+    // selection state of each stream's spike channels by local index, keyed by stream key
+    std::map<String, std::vector<bool>> spikeChannelSelection;
+    std::map<String, StringArray> selectionIdentifiers;   // identifiers the selection was last matched to
+    std::map<String, bool> pendingSelection;              // loaded from per-channel XML, not yet matched
+    std::map<String, std::vector<bool>> pendingStreamSelection;   // by stream key; loaded from XML or kept from a removed stream, not yet matched
 
     // functions
     int getNumActiveElectrodes();
     void updateSettings() override;;
+    static String getStreamKey(const DataStream* stream);
+    void removeStaleStreams();
+    void applySpikeChannelSelection();
+    int getOutputChannel(const DataStream* stream, Parameter* param);
+    void updateCoefficients(const DataStream* stream);
+    void updateAudioCoefficients();
+    void swapInCoefficients();
+    void writeSamples(MeanSpikeRateState& state, int endSample);
 
     // internals
     StreamSettings<MeanSpikeRateSettings> settings;
-    std::map<uint16, int> currSample;          // per-buffer - allows processing samples while handling events
-    std::map<uint16, double> spikeAmp;         // updated once per buffer
-    std::map<uint16, float> currMean;
-    std::map<uint16, float*> wpBuffer;
-    std::map<uint16, double> decayPerSample;   // updated once per buffer
+    std::map<uint16, MeanSpikeRateState> streamState;   // entries are only added in updateSettings()
+
+    // coefficients are written to pendingCoefficients and swapped into streamState by the audio thread
+    // when the version changes, so the audio thread never allocates, frees or sees a partial update
+    std::map<uint16, std::unique_ptr<MeanSpikeRateCoefficients>> pendingCoefficients;
+    SpinLock coefficientLock;
+    Atomic<int> coefficientVersion;
+    int audioCoefficientVersion;
+
+    // warm start
+    std::map<String, float> snapshotMean;      // currMean at the end of the last acquisition, by stream key
+    const double PREFILL_WINDOW_MS = 200.0;    // prefill window length (or Time_Const, if shorter)
+
+    // rate history
+    RateHistoryRecorder historyRecorder;
+    bool recordHistory;
+    float historyRateHz;
 
     const String OUTPUT_TOOLTIP = "Continuous channel to overwrite with the spike rate (meaned over time and selected electrodes)";
     const String TIME_CONST_TOOLTIP = "Time for the influence of a single spike to decay to 36.8% (1/e) of its initial value (larger = smoother, smaller = faster reaction to changes)";
+    const String WARM_START_TOOLTIP = "How to initialize the rate when acquisition starts: from zero, from the rate at the end of the last acquisition, or seeded from the spike count in a short window";
+    const String RECORD_HISTORY_TOOLTIP = "Write a downsampled history of the output rate to the recording directory while acquisition is running";
+    const String HISTORY_RATE_TOOLTIP = "Sample rate (Hz) of the recorded rate history";
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MeanSpikeRate);
 };
@@ -50,6 +50,11 @@ MeanSpikeRateEditor::MeanSpikeRateEditor(MeanSpikeRate* parentNode)
 
     addSelectedChannelsParameterEditor("Output", 10, yPos + TEXT_HEIGHT);
     addTextBoxParameterEditor("Time_Const", 100, yPos);
+    addComboBoxParameterEditor("Warm_Start", 190, 30);
+
+    // rate history
+    addToggleParameterEditor("Record_History", 280, 30);
+    addTextBoxParameterEditor("History_Hz", 280, yPos);
 }
 
 MeanSpikeRateEditor::~MeanSpikeRateEditor() {}
@@ -131,7 +136,15 @@ void MeanSpikeRateEditor::buttonClicked(Button* button)
 
     bool isActive = electrodeButton->getToggleState();
 
-    processor->spikeChannelActive[electrodeButton->getIdentifier()] = isActive;
+    // look up the channel's current stream and index, which may have changed since the button was made
+    for (auto spikeChannel : processor->spikeChannels)
+    {
+        if (spikeChannel->getIdentifier() == electrodeButton->getIdentifier())
+        {
+            processor->setActive(spikeChannel->getStreamId(), spikeChannel->getLocalIndex(), isActive);
+            return;
+        }
+    }
 }
 
 bool MeanSpikeRateEditor::getSpikeChannelEnabled(int index)
@@ -122,7 +122,7 @@ private:
     static const int BUTTON_WIDTH = 35;
     static const int BUTTON_HEIGHT = 15;
 
-    static const int WIDTH = 200;
+    static const int WIDTH = 370;
     static const int VIEWPORT_WIDTH = 170;
     static const int VIEWPORT_HEIGHT = 50;
     static const int BUTTONS_PER_ROW = 4; //CONTENT_WIDTH / BUTTON_WIDTH;
@@ -0,0 +1,541 @@
+/*
+------------------------------------------------------------------
+
+This file is part of a plugin for the Open Ephys GUI
+Copyright (C) 2018 Translational NeuroEngineering Laboratory, MGH
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "RateHistoryRecorder.h"
+
+using namespace RateHistoryFormat;
+
+namespace
+{
+    const char* HEADER_MAGIC = "MSRH";
+    const char* CHUNK_MAGIC = "CHNK";
+    const char* INDEX_MAGIC = "INDX";
+    const char* FOOTER_MAGIC = "MSRE";
+
+    int readInt(const uint8* p) { return (int)ByteOrder::littleEndianInt(p); }
+    int64 readInt64(const uint8* p) { return (int64)ByteOrder::littleEndianInt64(p); }
+
+    float readFloat(const uint8* p)
+    {
+        uint32 bits = ByteOrder::littleEndianInt(p);
+        float value;
+        memcpy(&value, &bits, sizeof(float));
+        return value;
+    }
+}
+
+/* -------- RateHistoryRecorder ----------- */
+
+RateHistoryRecorder::RateHistoryRecorder()
+    : Thread("Rate History Writer")
+    , fifo(FIFO_SIZE)
+{
+    fifoBuffer.allocate(FIFO_SIZE, true);
+}
+
+RateHistoryRecorder::~RateHistoryRecorder()
+{
+    stop();
+}
+
+bool RateHistoryRecorder::start(const File& file, float historyRateHz, const Array<RateHistoryStreamInfo>& streams)
+{
+    stop();
+
+    // never overwrite an earlier history file
+    if (file.exists())
+    {
+        return false;
+    }
+
+    output = std::make_unique<FileOutputStream>(file);
+    if (output->failedToOpen())
+    {
+        output.reset();
+        return false;
+    }
+
+    streamInfo.clearQuick();
+    streamIndex.clear();
+    windows.clearQuick();
+    pending.clear();
+    chunkIndex.clearQuick();
+
+    for (auto info : streams)
+    {
+        // average over windows of an integer number of samples, so the achieved rate may differ slightly from the requested one
+        info.decimation = jmax(1, roundToInt(info.sampleRate / historyRateHz));
+        streamIndex[info.streamId] = streamInfo.size();
+        streamInfo.add(info);
+
+        windows.add({ 0.0, 0, -1 });
+
+        auto chunk = pending.add(new PendingChunk());
+        chunk->values.ensureStorageAllocated(CHUNK_SIZE);
+        chunk->firstSampleNumber = 0;
+        chunk->nextSampleNumber = 0;
+    }
+
+    output->write(HEADER_MAGIC, 4);
+    output->writeInt(VERSION);
+    output->writeInt(CHUNK_SIZE);
+    output->writeFloat(historyRateHz);
+    output->writeInt64(Time::currentTimeMillis());
+    output->writeInt(streamInfo.size());
+
+    for (auto& info : streamInfo)
+    {
+        output->writeInt(info.streamId);
+        output->writeFloat(info.sampleRate);
+        output->writeInt(info.decimation);
+    }
+
+    fifo.reset();
+    numDropped = 0;
+    recording = 1;
+
+    startThread();
+
+    return true;
+}
+
+void RateHistoryRecorder::stop()
+{
+    if (!isRecording())
+    {
+        return;
+    }
+
+    recording = 0;
+    stopThread(1000);
+
+    // write out whatever is left
+    drainFifo();
+    for (int i = 0; i < pending.size(); ++i)
+    {
+        writeChunk(i);
+    }
+    writeIndex();
+
+    output.reset();
+}
+
+void RateHistoryRecorder::pushBlock(uint16 streamId, int64 firstSampleNumber, const float* data, int numSamples)
+{
+    auto it = streamIndex.find(streamId);
+    if (it == streamIndex.end())
+    {
+        return;
+    }
+
+    const int index = it->second;
+    const int decimation = streamInfo.getReference(index).decimation;
+    Window& window = windows.getReference(index);
+
+    // discard a partially filled window after a gap in the input
+    if (firstSampleNumber != window.nextSampleNumber)
+    {
+        window.sum = 0;
+        window.count = 0;
+    }
+    window.nextSampleNumber = firstSampleNumber + numSamples;
+
+    // windows are aligned to the sample numbers, not to the block boundaries
+    int phase = (int)(firstSampleNumber % decimation);
+    const int maxValues = (phase + numSamples) / decimation;
+
+    int start1, size1, start2, size2;
+    fifo.prepareToWrite(maxValues, start1, size1, start2, size2);
+
+    int numWritten = 0;
+    int numLost = 0;
+
+    for (int samp = 0; samp < numSamples; ++samp)
+    {
+        window.sum += data[samp];
+        window.count++;
+
+        if (++phase < decimation)
+        {
+            continue;
+        }
+
+        // only complete windows are recorded
+        if (window.count == decimation)
+        {
+            if (numWritten < size1 + size2)
+            {
+                const int slot = numWritten < size1 ? start1 + numWritten : start2 + numWritten - size1;
+                fifoBuffer[slot] = { index, firstSampleNumber + samp + 1 - decimation, float(window.sum / decimation) };
+                numWritten++;
+            }
+            else
+            {
+                numLost++;
+            }
+        }
+
+        window.sum = 0;
+        window.count = 0;
+        phase = 0;
+    }
+
+    fifo.finishedWrite(numWritten);
+
+    if (numLost > 0)
+    {
+        numDropped += numLost;
+    }
+}
+
+/* -------- private ----------- */
+
+void RateHistoryRecorder::run()
+{
+    while (!threadShouldExit())
+    {
+        drainFifo();
+        wait(WRITE_INTERVAL_MS);
+    }
+}
+
+void RateHistoryRecorder::drainFifo()
+{
+    int start1, size1, start2, size2;
+    fifo.prepareToRead(fifo.getNumReady(), start1, size1, start2, size2);
+
+    for (int i = 0; i < size1; ++i)
+    {
+        appendValue(fifoBuffer[start1 + i]);
+    }
+    for (int i = 0; i < size2; ++i)
+    {
+        appendValue(fifoBuffer[start2 + i]);
+    }
+
+    fifo.finishedRead(size1 + size2);
+}
+
+void RateHistoryRecorder::appendValue(const Entry& entry)
+{
+    PendingChunk* chunk = pending[entry.streamIndex];
+
+    // start a new chunk after a gap (skipped blocks or dropped values)
+    if (chunk->values.size() > 0 && entry.sampleNumber != chunk->nextSampleNumber)
+    {
+        writeChunk(entry.streamIndex);
+    }
+
+    if (chunk->values.size() == 0)
+    {
+        chunk->firstSampleNumber = entry.sampleNumber;
+    }
+
+    chunk->values.add(entry.value);
+    chunk->nextSampleNumber = entry.sampleNumber + streamInfo.getReference(entry.streamIndex).decimation;
+
+    if (chunk->values.size() == CHUNK_SIZE)
+    {
+        writeChunk(entry.streamIndex);
+    }
+}
+
+void RateHistoryRecorder::writeChunk(int index)
+{
+    PendingChunk* chunk = pending[index];
+    const int numValues = chunk->values.size();
+
+    if (numValues == 0)
+    {
+        return;
+    }
+
+    chunkIndex.add({ index, chunk->firstSampleNumber, numValues, output->getPosition() });
+
+    output->write(CHUNK_MAGIC, 4);
+    output->writeInt(index);
+    output->writeInt64(chunk->firstSampleNumber);
+    output->writeInt(numValues);
+
+    for (auto value : chunk->values)
+    {
+        output->writeFloat(value);
+    }
+    for (int i = numValues; i < CHUNK_SIZE; ++i)
+    {
+        output->writeFloat(0.0f);
+    }
+
+    chunk->values.clearQuick();
+}
+
+void RateHistoryRecorder::writeIndex()
+{
+    const int64 indexOffset = output->getPosition();
+
+    output->write(INDEX_MAGIC, 4);
+    output->writeInt(chunkIndex.size());
+
+    for (auto& entry : chunkIndex)
+    {
+        output->writeInt(entry.streamIndex);
+        output->writeInt64(entry.firstSampleNumber);
+        output->writeInt(entry.numValues);
+        output->writeInt64(entry.offset);
+    }
+
+    output->writeInt64(indexOffset);
+    output->write(FOOTER_MAGIC, 4);
+    output->flush();
+}
+
+/* -------- RateHistoryReader ----------- */
+
+RateHistoryReader::RateHistoryReader(const File& file)
+    : data(nullptr)
+    , size(0)
+    , valid(false)
+    , complete(false)
+    , historyRateHz(0)
+    , startTime(0)
+    , firstChunkOffset(0)
+{
+    map = std::make_unique<MemoryMappedFile>(file, MemoryMappedFile::readOnly);
+    data = static_cast<const uint8*>(map->getData());
+    size = (int64)map->getSize();
+
+    if (data == nullptr || !parseHeader())
+    {
+        return;
+    }
+
+    // fall back to scanning if the file was not closed cleanly
+    complete = parseIndex();
+    if (!complete)
+    {
+        for (auto& streamChunks : chunks)
+        {
+            streamChunks.clear();
+        }
+        scanChunks();
+    }
+
+    valid = true;
+}
+
+RateHistoryReader::~RateHistoryReader() {}
+
+int64 RateHistoryReader::getNumValues(int streamIndex) const
+{
+    if (!isPositiveAndBelow(streamIndex, (int)chunks.size()) || chunks[streamIndex].empty())
+    {
+        return 0;
+    }
+
+    const Chunk& last = chunks[streamIndex].back();
+    return last.firstValue + last.numValues;
+}
+
+int64 RateHistoryReader::getSampleNumber(int streamIndex, int64 valueIndex) const
+{
+    const int c = findChunk(streamIndex, valueIndex);
+    if (c < 0)
+    {
+        return -1;
+    }
+
+    const Chunk& chunk = chunks[streamIndex][c];
+    return chunk.firstSampleNumber + (valueIndex - chunk.firstValue) * streamInfo[streamIndex].decimation;
+}
+
+int64 RateHistoryReader::findValue(int streamIndex, int64 sampleNumber) const
+{
+    const int64 numValues = getNumValues(streamIndex);
+    if (numValues == 0)
+    {
+        return 0;
+    }
+
+    const std::vector<Chunk>& streamChunks = chunks[streamIndex];
+    auto it = std::upper_bound(streamChunks.begin(), streamChunks.end(), sampleNumber,
+        [](int64 value, const Chunk& chunk) { return value < chunk.firstSampleNumber; });
+
+    if (it == streamChunks.begin())
+    {
+        return 0;
+    }
+
+    // round up to the first window starting at or after sampleNumber
+    const Chunk& chunk = *(it - 1);
+    const int decimation = streamInfo[streamIndex].decimation;
+    const int64 offset = (sampleNumber - chunk.firstSampleNumber + decimation - 1) / decimation;
+
+    return chunk.firstValue + jmin(offset, (int64)chunk.numValues);
+}
+
+int RateHistoryReader::readValues(int streamIndex, int64 startValue, int numValues, float* dest) const
+{
+    int c = findChunk(streamIndex, startValue);
+    if (c < 0)
+    {
+        return 0;
+    }
+
+    const std::vector<Chunk>& streamChunks = chunks[streamIndex];
+    int numRead = 0;
+
+    for (; c < (int)streamChunks.size() && numRead < numValues; ++c)
+    {
+        const Chunk& chunk = streamChunks[c];
+        const int64 firstInChunk = startValue + numRead - chunk.firstValue;
+        const int numToCopy = (int)jmin((int64)(numValues - numRead), chunk.numValues - firstInChunk);
+
+        const uint8* values = data + chunk.offset + CHUNK_HEADER_SIZE + firstInChunk * sizeof(float);
+        for (int i = 0; i < numToCopy; ++i)
+        {
+            dest[numRead++] = readFloat(values + i * sizeof(float));
+        }
+    }
+
+    return numRead;
+}
+
+/* -------- private ----------- */
+
+bool RateHistoryReader::parseHeader()
+{
+    if (size < HEADER_SIZE || memcmp(data, HEADER_MAGIC, 4) != 0)
+    {
+        return false;
+    }
+
+    if (readInt(data + 4) != VERSION || readInt(data + 8) != CHUNK_SIZE)
+    {
+        return false;
+    }
+
+    historyRateHz = readFloat(data + 12);
+    startTime = readInt64(data + 16);
+
+    const int numStreams = readInt(data + 24);
+    firstChunkOffset = HEADER_SIZE + (int64)numStreams * STREAM_ENTRY_SIZE;
+
+    if (numStreams < 0 || firstChunkOffset > size)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < numStreams; ++i)
+    {
+        const uint8* entry = data + HEADER_SIZE + i * STREAM_ENTRY_SIZE;
+
+        RateHistoryStreamInfo info;
+        info.streamId = (uint16)readInt(entry);
+        info.sampleRate = readFloat(entry + 4);
+        info.decimation = readInt(entry + 8);
+        streamInfo.add(info);
+    }
+
+    chunks.resize(numStreams);
+
+    return true;
+}
+
+bool RateHistoryReader::parseIndex()
+{
+    if (size < firstChunkOffset + INDEX_HEADER_SIZE + FOOTER_SIZE
+        || memcmp(data + size - 4, FOOTER_MAGIC, 4) != 0)
+    {
+        return false;
+    }
+
+    const int64 indexOffset = readInt64(data + size - FOOTER_SIZE);
+    if (indexOffset < firstChunkOffset
+        || indexOffset + INDEX_HEADER_SIZE > size - FOOTER_SIZE
+        || memcmp(data + indexOffset, INDEX_MAGIC, 4) != 0)
+    {
+        return false;
+    }
+
+    const int numChunks = readInt(data + indexOffset + 4);
+    if (numChunks < 0 || indexOffset + INDEX_HEADER_SIZE + (int64)numChunks * INDEX_ENTRY_SIZE > size - FOOTER_SIZE)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < numChunks; ++i)
+    {
+        const uint8* entry = data + indexOffset + INDEX_HEADER_SIZE + i * INDEX_ENTRY_SIZE;
+        const int64 offset = readInt64(entry + 16);
+
+        if (offset < firstChunkOffset || offset + CHUNK_BYTES > indexOffset)
+        {
+            return false;
+        }
+
+        addChunk(readInt(entry), readInt64(entry + 4), readInt(entry + 12), offset);
+    }
+
+    return true;
+}
+
+void RateHistoryReader::scanChunks()
+{
+    for (int64 offset = firstChunkOffset; offset + CHUNK_BYTES <= size; offset += CHUNK_BYTES)
+    {
+        const uint8* chunk = data + offset;
+        if (memcmp(chunk, CHUNK_MAGIC, 4) != 0)
+        {
+            break;
+        }
+
+        addChunk(readInt(chunk + 4), readInt64(chunk + 8), readInt(chunk + 16), offset);
+    }
+}
+
+void RateHistoryReader::addChunk(int streamIndex, int64 firstSampleNumber, int numValues, int64 offset)
+{
+    if (!isPositiveAndBelow(streamIndex, (int)chunks.size()))
+    {
+        return;
+    }
+
+    std::vector<Chunk>& streamChunks = chunks[streamIndex];
+    const int64 firstValue = streamChunks.empty() ? 0 : streamChunks.back().firstValue + streamChunks.back().numValues;
+
+    streamChunks.push_back({ firstValue, firstSampleNumber, jlimit(0, CHUNK_SIZE, numValues), offset });
+}
+
+int RateHistoryReader::findChunk(int streamIndex, int64 valueIndex) const
+{
+    if (valueIndex < 0 || valueIndex >= getNumValues(streamIndex))
+    {
+        return -1;
+    }
+
+    const std::vector<Chunk>& streamChunks = chunks[streamIndex];
+    auto it = std::upper_bound(streamChunks.begin(), streamChunks.end(), valueIndex,
+        [](int64 value, const Chunk& chunk) { return value < chunk.firstValue; });
+
+    return (int)(it - streamChunks.begin()) - 1;
+}
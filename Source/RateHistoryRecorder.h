@@ -0,0 +1,245 @@
+/*
+------------------------------------------------------------------
+
+This file is part of a plugin for the Open Ephys GUI
+Copyright (C) 2018 Translational NeuroEngineering Laboratory, MGH
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef RATE_HISTORY_RECORDER_H_INCLUDED
+#define RATE_HISTORY_RECORDER_H_INCLUDED
+
+#include <ProcessorHeaders.h>
+
+/*
+ * Rate history file layout (all values little-endian):
+ *
+ *   Header:  "MSRH", int32 version, int32 chunkSize, float historyRateHz,
+ *            int64 startTime (ms since epoch), int32 numStreams,
+ *            numStreams x { int32 streamId, float sampleRate, int32 decimation }
+ *
+ *   Chunks:  "CHNK", int32 streamIndex, int64 firstSampleNumber, int32 numValues,
+ *            float values[chunkSize] (zero-padded past numValues)
+ *
+ *   Index:   "INDX", int32 numChunks,
+ *            numChunks x { int32 streamIndex, int64 firstSampleNumber, int32 numValues, int64 offset }
+ *
+ *   Footer:  int64 indexOffset, "MSRE"
+ *
+ * Each value is the mean of the output over a window of `decimation` samples; its sample
+ * number is the first sample of that window.
+ *
+ * Chunks have a fixed size, so a file that was not closed cleanly (no index or footer)
+ * can still be read by scanning the chunks in order.
+ */
+namespace RateHistoryFormat
+{
+    const int VERSION = 1;
+    const int CHUNK_SIZE = 1024;
+
+    const int HEADER_SIZE = 28;
+    const int STREAM_ENTRY_SIZE = 12;
+    const int CHUNK_HEADER_SIZE = 20;
+    const int CHUNK_BYTES = CHUNK_HEADER_SIZE + CHUNK_SIZE * sizeof(float);
+    const int INDEX_HEADER_SIZE = 8;
+    const int INDEX_ENTRY_SIZE = 24;
+    const int FOOTER_SIZE = 12;
+}
+
+/**
+
+    Describes one stream in a rate history file
+
+*/
+struct RateHistoryStreamInfo
+{
+    uint16 streamId;
+    float sampleRate;
+    int decimation;
+};
+
+/**
+
+    Records a downsampled copy of the output rate of each stream to disk.
+
+    The audio thread pushes values into a lock-free FIFO via pushBlock(); a background
+    thread drains the FIFO and appends fixed-size chunks to the file.
+
+*/
+class RateHistoryRecorder : private Thread
+{
+public:
+
+    /** Constructor */
+    RateHistoryRecorder();
+
+    /** Destructor */
+    ~RateHistoryRecorder();
+
+    /** Creates the file and starts the writer thread. Returns false if the file already exists or could not be opened. */
+    bool start(const File& file, float historyRateHz, const Array<RateHistoryStreamInfo>& streams);
+
+    /** Stops the writer thread, flushes pending values and writes the index */
+    void stop();
+
+    /** Returns true while a file is being written */
+    bool isRecording() const { return recording.get() != 0; }
+
+    /** Returns the number of values dropped because the FIFO was full */
+    int getNumDropped() const { return numDropped.get(); }
+
+    /** Queues the window means completed by one block of output (called from the audio thread) */
+    void pushBlock(uint16 streamId, int64 firstSampleNumber, const float* data, int numSamples);
+
+private:
+
+    struct Entry
+    {
+        int streamIndex;
+        int64 sampleNumber;
+        float value;
+    };
+
+    struct Window
+    {
+        double sum;
+        int count;
+        int64 nextSampleNumber;
+    };
+
+    struct PendingChunk
+    {
+        Array<float> values;
+        int64 firstSampleNumber;
+        int64 nextSampleNumber;
+    };
+
+    struct ChunkIndexEntry
+    {
+        int streamIndex;
+        int64 firstSampleNumber;
+        int numValues;
+        int64 offset;
+    };
+
+    void run() override;
+
+    void drainFifo();
+    void appendValue(const Entry& entry);
+    void writeChunk(int streamIndex);
+    void writeIndex();
+
+    Array<RateHistoryStreamInfo> streamInfo;
+    std::map<uint16, int> streamIndex;
+    Array<Window> windows;    // only accessed by the audio thread while recording
+
+    AbstractFifo fifo;
+    HeapBlock<Entry> fifoBuffer;
+
+    std::unique_ptr<FileOutputStream> output;
+    OwnedArray<PendingChunk> pending;
+    Array<ChunkIndexEntry> chunkIndex;
+
+    Atomic<int> recording;
+    Atomic<int> numDropped;
+
+    static const int FIFO_SIZE = 1 << 16;
+    static const int WRITE_INTERVAL_MS = 50;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(RateHistoryRecorder);
+};
+
+/**
+
+    Reads a rate history file through a memory map, so that
+    segments of long sessions can be accessed without loading the whole file.
+
+*/
+class RateHistoryReader
+{
+public:
+
+    /** Constructor */
+    RateHistoryReader(const File& file);
+
+    /** Destructor */
+    ~RateHistoryReader();
+
+    /** Returns true if the file was opened and its header parsed */
+    bool isValid() const { return valid; }
+
+    /** Returns true if the file was closed cleanly and its index was read */
+    bool isComplete() const { return complete; }
+
+    /** Returns the nominal history rate requested when recording */
+    float getHistoryRate() const { return historyRateHz; }
+
+    /** Returns the time at which recording started (ms since epoch) */
+    int64 getStartTime() const { return startTime; }
+
+    /** Returns the number of streams in the file */
+    int getNumStreams() const { return streamInfo.size(); }
+
+    /** Returns information about a stream */
+    RateHistoryStreamInfo getStreamInfo(int streamIndex) const { return streamInfo[streamIndex]; }
+
+    /** Returns the total number of values recorded for a stream */
+    int64 getNumValues(int streamIndex) const;
+
+    /** Returns the source sample number of a given value */
+    int64 getSampleNumber(int streamIndex, int64 valueIndex) const;
+
+    /** Returns the index of the first value at or after a source sample number (getNumValues() if there is none) */
+    int64 findValue(int streamIndex, int64 sampleNumber) const;
+
+    /** Copies up to numValues values starting at startValue; returns the number copied */
+    int readValues(int streamIndex, int64 startValue, int numValues, float* dest) const;
+
+private:
+
+    struct Chunk
+    {
+        int64 firstValue;
+        int64 firstSampleNumber;
+        int numValues;
+        int64 offset;
+    };
+
+    bool parseHeader();
+    bool parseIndex();
+    void scanChunks();
+    void addChunk(int streamIndex, int64 firstSampleNumber, int numValues, int64 offset);
+    int findChunk(int streamIndex, int64 valueIndex) const;
+
+    std::unique_ptr<MemoryMappedFile> map;
+    const uint8* data;
+    int64 size;
+
+    bool valid;
+    bool complete;
+    float historyRateHz;
+    int64 startTime;
+    int64 firstChunkOffset;
+
+    Array<RateHistoryStreamInfo> streamInfo;
+    std::vector<std::vector<Chunk>> chunks;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(RateHistoryReader);
+};
+
+#endif // RATE_HISTORY_RECORDER_H_INCLUDED
@@ -0,0 +1,35 @@
+/*
+------------------------------------------------------------------
+
+This file is part of a plugin for the Open Ephys GUI
+Copyright (C) 2018 Translational NeuroEngineering Laboratory, MGH
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef TESTS_PROCESSOR_HEADERS_H_INCLUDED
+#define TESTS_PROCESSOR_HEADERS_H_INCLUDED
+
+/*
+ * Stands in for the GUI's ProcessorHeaders.h in the test build, so that classes
+ * which only need juce_core (such as RateHistoryRecorder) can be tested without the GUI.
+ */
+#include <juce_core/juce_core.h>
+
+using namespace juce;
+
+#endif // TESTS_PROCESSOR_HEADERS_H_INCLUDED
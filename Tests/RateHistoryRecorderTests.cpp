@@ -0,0 +1,189 @@
+/*
+------------------------------------------------------------------
+
+This file is part of a plugin for the Open Ephys GUI
+Copyright (C) 2018 Translational NeuroEngineering Laboratory, MGH
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "RateHistoryRecorder.h"
+
+#if JUCE_UNIT_TESTS
+
+/**
+
+    Writes a rate history file with RateHistoryRecorder and reads it back with RateHistoryReader
+
+*/
+class RateHistoryRecorderTests : public UnitTest
+{
+public:
+
+    RateHistoryRecorderTests() : UnitTest("Rate History Recorder", "MeanSpikeRate") {}
+
+    void runTest() override
+    {
+        File file = File::createTempFile(".msrh");
+
+        // stream 0: 30 kHz -> decimation 300; stream 1: 1 kHz -> decimation 10
+        Array<RateHistoryStreamInfo> streams;
+        streams.add({ 100, 30000.0f, 1 });
+        streams.add({ 101, 1000.0f, 1 });
+
+        const int BLOCK_SIZE = 1024;
+        HeapBlock<float> block(BLOCK_SIZE);
+
+        beginTest("Round trip");
+        {
+            RateHistoryRecorder recorder;
+            expect(recorder.start(file, 100.0f, streams));
+
+            // stream 100: a ramp over 3000 blocks (3072000 samples -> 10240 windows, 10 chunks)
+            for (int64 first = 0; first < 3000 * BLOCK_SIZE; first += BLOCK_SIZE)
+            {
+                fillRamp(block, first, BLOCK_SIZE);
+                recorder.pushBlock(100, first, block, BLOCK_SIZE);
+            }
+
+            // stream 101: two runs separated by a gap, starting mid-window
+            for (int64 first = 5; first < 5 + 20 * BLOCK_SIZE; first += BLOCK_SIZE)
+            {
+                fillRamp(block, first, BLOCK_SIZE);
+                recorder.pushBlock(101, first, block, BLOCK_SIZE);
+            }
+            for (int64 first = 100000; first < 100000 + 10 * BLOCK_SIZE; first += BLOCK_SIZE)
+            {
+                fillRamp(block, first, BLOCK_SIZE);
+                recorder.pushBlock(101, first, block, BLOCK_SIZE);
+            }
+
+            recorder.stop();
+            expectEquals(recorder.getNumDropped(), 0);
+        }
+
+        checkFile(file, true);
+
+        beginTest("Existing file");
+        {
+            const int64 fileSize = file.getSize();
+
+            RateHistoryRecorder recorder;
+            expect(!recorder.start(file, 100.0f, streams));
+            expectEquals(file.getSize(), fileSize);
+        }
+
+        beginTest("Read without index");
+        {
+            MemoryBlock contents;
+            expect(file.loadFileAsData(contents));
+
+            // drop the footer, as if the file had not been closed cleanly
+            contents.setSize(contents.getSize() - RateHistoryFormat::FOOTER_SIZE);
+
+            File truncated = File::createTempFile(".msrh");
+            expect(truncated.replaceWithData(contents.getData(), contents.getSize()));
+
+            checkFile(truncated, false);
+            truncated.deleteFile();
+        }
+
+        file.deleteFile();
+    }
+
+private:
+
+    static void fillRamp(float* data, int64 firstSampleNumber, int numSamples)
+    {
+        for (int i = 0; i < numSamples; ++i)
+        {
+            data[i] = float((firstSampleNumber + i) % 1000);
+        }
+    }
+
+    /** Mean of the ramp over a window of samples */
+    static float rampMean(int64 firstSampleNumber, int decimation)
+    {
+        double sum = 0;
+        for (int64 s = firstSampleNumber; s < firstSampleNumber + decimation; ++s)
+        {
+            sum += double(s % 1000);
+        }
+        return float(sum / decimation);
+    }
+
+    void checkFile(const File& file, bool expectComplete)
+    {
+        RateHistoryReader reader(file);
+        expect(reader.isValid());
+        expect(reader.isComplete() == expectComplete);
+        expectEquals(reader.getNumStreams(), 2);
+        expectEquals(reader.getHistoryRate(), 100.0f);
+
+        RateHistoryStreamInfo info0 = reader.getStreamInfo(0);
+        RateHistoryStreamInfo info1 = reader.getStreamInfo(1);
+        expectEquals((int)info0.streamId, 100);
+        expectEquals(info0.decimation, 300);
+        expectEquals((int)info1.streamId, 101);
+        expectEquals(info1.decimation, 10);
+
+        // stream 100: contiguous windows from sample 0
+        const int64 numValues0 = 3000 * 1024 / 300;
+        expectEquals(reader.getNumValues(0), numValues0);
+
+        HeapBlock<float> values((size_t)numValues0);
+        expectEquals(reader.readValues(0, 0, (int)numValues0, values), (int)numValues0);
+
+        for (int64 v = 0; v < numValues0; ++v)
+        {
+            expectEquals(reader.getSampleNumber(0, v), v * 300);
+            expectWithinAbsoluteError(values[(int)v], rampMean(v * 300, 300), 0.01f);
+        }
+
+        // reads spanning a chunk boundary
+        expectEquals(reader.readValues(0, 1020, 8, values), 8);
+        expectWithinAbsoluteError(values[0], rampMean(1020 * 300, 300), 0.01f);
+        expectWithinAbsoluteError(values[7], rampMean(1027 * 300, 300), 0.01f);
+
+        expectEquals(reader.findValue(0, 0), (int64)0);
+        expectEquals(reader.findValue(0, 299), (int64)1);
+        expectEquals(reader.findValue(0, 300), (int64)1);
+        expectEquals(reader.findValue(0, 1025 * 300), (int64)1025);
+        expectEquals(reader.findValue(0, 1000000000), numValues0);
+
+        // stream 101: the partial window at sample 5 is skipped, so the first run
+        // has windows starting at 10 through 20470, the second at 100000 through 110230
+        const int64 numRun1 = (5 + 20 * 1024) / 10 - 1;
+        const int64 numRun2 = 10 * 1024 / 10;
+        expectEquals(reader.getNumValues(1), numRun1 + numRun2);
+        expectEquals(reader.getSampleNumber(1, 0), (int64)10);
+        expectEquals(reader.getSampleNumber(1, numRun1 - 1), (int64)(numRun1 * 10));
+        expectEquals(reader.getSampleNumber(1, numRun1), (int64)100000);
+
+        float value;
+        expectEquals(reader.readValues(1, numRun1, 1, &value), 1);
+        expectWithinAbsoluteError(value, rampMean(100000, 10), 0.01f);
+
+        // seeking into the gap lands on the first value after it
+        expectEquals(reader.findValue(1, 50000), numRun1);
+        expectEquals(reader.findValue(1, 100010), numRun1 + 1);
+    }
+};
+
+static RateHistoryRecorderTests rateHistoryRecorderTests;
+
+#endif